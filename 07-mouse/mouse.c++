@@ -34,6 +34,7 @@
 
 #include <cstring>
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -57,6 +58,103 @@ using namespace boost;
 #include <SDL/SDL_ttf.h>
 
 
+// The parts of the screen that have changed since the last frame.  Anything
+// that moves or changes marks the rectangles it touches, and a frame then
+// redraws and updates only those instead of the whole screen.
+class DirtyRegions
+{
+  private:
+
+    // Past this many separate rectangles it is cheaper to just redraw the
+    // whole screen than to keep track of them all.
+    static const unsigned int _max_rectangles = 64;
+
+    SDL_Rect _bounds;
+    vector<SDL_Rect> _rectangles;
+
+  public:
+
+    static bool intersect(const SDL_Rect &a, const SDL_Rect &b,
+        SDL_Rect *result = NULL)
+    {
+      int left = max(a.x, b.x);
+      int top = max(a.y, b.y);
+      int right = min(a.x + a.w, b.x + b.w);
+      int bottom = min(a.y + a.h, b.y + b.h);
+      if (right <= left || bottom <= top) {
+        return false;
+      }
+      if (result) {
+        result->x = left;
+        result->y = top;
+        result->w = right - left;
+        result->h = bottom - top;
+      }
+      return true;
+    }
+
+    DirtyRegions(unsigned int width = SCREEN_WIDTH,
+        unsigned int height = SCREEN_HEIGHT)
+    {
+      _bounds.x = 0;
+      _bounds.y = 0;
+      _bounds.w = width;
+      _bounds.h = height;
+      _rectangles.reserve(_max_rectangles + 1);
+    }
+
+    void mark(const SDL_Rect &rectangle)
+    {
+      SDL_Rect dirty;
+      if (!intersect(rectangle, _bounds, &dirty)) {
+        return;
+      }
+      // Overlapping rectangles get merged so nothing is drawn twice.
+      for (size_t i = 0; i < _rectangles.size(); ) {
+        SDL_Rect &other = _rectangles[i];
+        if (intersect(dirty, other)) {
+          int left = min(dirty.x, other.x);
+          int top = min(dirty.y, other.y);
+          int right = max(dirty.x + dirty.w, other.x + other.w);
+          int bottom = max(dirty.y + dirty.h, other.y + other.h);
+          dirty.x = left;
+          dirty.y = top;
+          dirty.w = right - left;
+          dirty.h = bottom - top;
+          _rectangles.erase(_rectangles.begin() + i);
+          i = 0;
+        } else {
+          i++;
+        }
+      }
+      _rectangles.push_back(dirty);
+      if (_rectangles.size() > _max_rectangles) {
+        mark_all();
+      }
+    }
+
+    void mark_all(void)
+    {
+      _rectangles.assign(1, _bounds);
+    }
+
+    void clear(void)
+    {
+      _rectangles.clear();
+    }
+
+    bool empty(void) const
+    {
+      return _rectangles.empty();
+    }
+
+    vector<SDL_Rect> &rectangles(void)
+    {
+      return _rectangles;
+    }
+};
+
+
 class Text
 {
   private:
@@ -89,9 +187,21 @@ class Text
       if (_message) SDL_FreeSurface(_message);
     }
 
+    SDL_Rect rectangle(void) const
+    {
+      SDL_Rect rectangle = {0, 0, 0, 0};
+      if (_message) {
+        rectangle.w = _message->w;
+        rectangle.h = _message->h;
+      }
+      return rectangle;
+    }
+
     void blit(void)
     {
-      SDL_BlitSurface(_message, NULL, _screen, NULL);
+      if (_message) {
+        SDL_BlitSurface(_message, NULL, _screen, NULL);
+      }
     }
 };
 
@@ -156,17 +266,37 @@ class Tile
       _y = y;
       _rectangle.x = _x * TILE_WIDTH;
       _rectangle.y = _y * TILE_HEIGHT;
+      _rectangle.w = TILE_WIDTH;
+      _rectangle.h = TILE_HEIGHT;
     }
 
     void blit(void)
     {
       if (_screen && _tile_type) {
+        // SDL_BlitSurface writes the clipped rectangle back, so hand it a
+        // copy to keep our own position intact.
+        SDL_Rect rectangle = _rectangle;
         SDL_BlitSurface(
             (SDL_Surface *) _tile_type->image(),
-            NULL, _screen, &_rectangle);
+            NULL, _screen, &rectangle);
       }
     }
 
+    const SDL_Rect &rectangle(void) const
+    {
+      return _rectangle;
+    }
+
+    const TileType *tile_type(void) const
+    {
+      return _tile_type;
+    }
+
+    const TileType *tile_type(const TileType *tile_type)
+    {
+      return _tile_type = tile_type;
+    }
+
     unsigned int x(void) const
     {
       return _x;
@@ -198,6 +328,7 @@ class Player
     static TileType *_tile_type;
 
     SDL_Surface *_screen;
+    DirtyRegions *_dirty;
     unsigned int _x;
     unsigned int _y;
     Tile _tile;
@@ -209,12 +340,14 @@ class Player
       _tile_type = new TileType(filepath);
     }
 
-    Player(SDL_Surface *screen)
+    Player(SDL_Surface *screen, DirtyRegions *dirty)
     {
       _screen = screen;
+      _dirty = dirty;
       _x = 0;
       _y = 0;
       _tile = Tile(_screen, _tile_type, _x, _y);
+      _dirty->mark(_tile.rectangle());
     }
 
     unsigned int x(void) const
@@ -227,6 +360,11 @@ class Player
       return _y;
     }
 
+    const SDL_Rect &rectangle(void) const
+    {
+      return _tile.rectangle();
+    }
+
     void blit(void)
     {
       _tile.blit();
@@ -235,28 +373,36 @@ class Player
     void move_left(void)
     {
       if (0 < _x) {
+        _dirty->mark(_tile.rectangle());
         _tile.x(--_x);
+        _dirty->mark(_tile.rectangle());
       }
     }
 
     void move_right(void)
     {
       if (_x < TILES_WIDTH_COUNT - 1) {
+        _dirty->mark(_tile.rectangle());
         _tile.x(++_x);
+        _dirty->mark(_tile.rectangle());
       }
     }
 
     void move_up(void)
     {
       if (0 < _y) {
+        _dirty->mark(_tile.rectangle());
         _tile.y(--_y);
+        _dirty->mark(_tile.rectangle());
       }
     }
 
     void move_down(void)
     {
       if (_y < TILES_HEIGHT_COUNT - 1) {
+        _dirty->mark(_tile.rectangle());
         _tile.y(++_y);
+        _dirty->mark(_tile.rectangle());
       }
     }
 };
@@ -294,14 +440,18 @@ class Game
 
     SDL_Event _event;
 
+    DirtyRegions _dirty;
+
     void _sdl_init(void)
     {
       if (!! SDL_Init(SDL_INIT_EVERYTHING)) {
         throw "SDL_Init failed.";
       }
+      // No SDL_DOUBLEBUF: only the dirty parts of the screen get pushed with
+      // SDL_UpdateRects, which needs a single buffer that keeps its contents
+      // between frames.
       _screen = SDL_SetVideoMode(
-          SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_COLOR_DEPTH,
-          SDL_SWSURFACE|SDL_DOUBLEBUF);
+          SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_COLOR_DEPTH, SDL_SWSURFACE);
       if (!_screen) {
         throw "Failed to set the screen video mode.";
       }
@@ -339,10 +489,27 @@ class Game
           _all_lawn.push_back(Tile(_screen, _lawn, i, j));
         }
       }
+      _dirty.mark_all();
     }
 
-    void _blit(void)
+    void _set_message(string text)
+    {
+      if (_message) {
+        _dirty.mark(_message->rectangle());
+        delete _message;
+      }
+      _message = new Text(_screen, text);
+      _dirty.mark(_message->rectangle());
+    }
+
+    void _redraw(const SDL_Rect &rectangle)
     {
+      // The tiles here overlap, so everything is drawn in the usual order
+      // and the clip rectangle keeps SDL from touching anything outside of
+      // the dirty region.
+      SDL_Rect clip = rectangle;
+      SDL_SetClipRect(_screen, &clip);
+      SDL_FillRect(_screen, &clip, SDL_MapRGB(_screen->format, 0, 0, 0));
       for (vector<Tile>::iterator lawn = _all_lawn.begin();
           lawn != _all_lawn.end();
           lawn++) {
@@ -359,7 +526,22 @@ class Game
       _wood5.blit();
       _player->blit();
       _message->blit();
-      SDL_Flip(_screen);
+    }
+
+    void _blit(void)
+    {
+      if (_dirty.empty()) {
+        return;
+      }
+      vector<SDL_Rect> &rectangles = _dirty.rectangles();
+      for (vector<SDL_Rect>::iterator rectangle = rectangles.begin();
+          rectangle != rectangles.end();
+          rectangle++) {
+        _redraw(*rectangle);
+      }
+      SDL_SetClipRect(_screen, NULL);
+      SDL_UpdateRects(_screen, rectangles.size(), &rectangles[0]);
+      _dirty.clear();
     }
 
     void _handle_event(void)
@@ -368,6 +550,9 @@ class Game
       if (_event.type == SDL_QUIT) {
         text += "SDL_QUIT";
         _quit = true;
+      } else if (_event.type == SDL_VIDEOEXPOSE) {
+        text += "SDL_VIDEOEXPOSE";
+        _dirty.mark_all();
       } else if (_event.type == SDL_KEYDOWN) {
         text += "SDL_KEYDOWN ";
         SDLKey key = _event.key.keysym.sym;
@@ -400,7 +585,7 @@ class Game
         text += " x = " + lexical_cast<string>(button.x);
         text += " y = " + lexical_cast<string>(button.y);
       }
-      _message = new Text(_screen, text);
+      _set_message(text);
     }
 
   public:
@@ -408,10 +593,11 @@ class Game
     Game(void)
     {
       _quit = false;
+      _message = NULL;
       _sdl_init();
       _load_images();
       _setup_tiles();
-      _player = new Player(_screen);
+      _player = new Player(_screen, &_dirty);
     }
 
     ~Game(void)
@@ -421,7 +607,7 @@ class Game
 
     void main_loop(void)
     {
-      _message = new Text(_screen, "Initialized");
+      _set_message("Initialized");
       while (!_quit) {
         _blit();
         while (SDL_PollEvent(&_event)) {